@@ -2,6 +2,8 @@
 
 #include <algorithm>
 
+#include "zone-trace.h"
+
 AccountingAllocator::AccountingAllocator() : unused_segments_mutex_() {
   memory_pressure_level_.SetValue(MemoryPressureLevel::kNone);
   std::fill(unused_segments_heads_,
@@ -9,32 +11,84 @@ AccountingAllocator::AccountingAllocator() : unused_segments_mutex_() {
                 (1 + kMaxSegmentSizePower - kMinSegmentSizePower),
             nullptr);
 
-  std::fill(unused_segments_sizes,
-            unused_segments_sizes + ( 1 + kMaxSegmentSizePower - kMinSegmentSizePower),
+  std::fill(unused_segments_sizes_,
+            unused_segments_sizes_ + ( 1 + kMaxSegmentSizePower - kMinSegmentSizePower),
             0);
+
+  std::fill(unused_segments_max_sizes_,
+            unused_segments_max_sizes_ +
+                (1 + kMaxSegmentSizePower - kMinSegmentSizePower),
+            kDefaultBucketMaxSize);
 }
 
 AccountingAllocator::~AccountingAllocator() { ClearPool(); }
 
-Segment* AccountingAllocator::GetSegment(size_t bytes) {
-  Segment* result = GetSegmentFromPool(bytes);
+Segment* AccountingAllocator::GetSegment(size_t bytes, size_t max_bytes) {
+  Segment* result = GetSegmentFromPool(bytes, max_bytes);
   if (result == nullptr) {
     result = AllocateSegment(bytes);
-    result->Initialize(bytes);
+    if (result == nullptr && hard_limit_ != 0) {
+      // Pooled segments count against the budget; give them back to the
+      // system and try once more before failing the request.
+      ClearPool();
+      result = AllocateSegment(bytes);
+    }
+    if (result != nullptr) result->Initialize(bytes);
   }
 
   return result;
 }
 
+void AccountingAllocator::SetMemoryBudget(size_t soft_limit,
+                                          size_t hard_limit,
+                                          MemoryBudgetCallback callback,
+                                          void* data) {
+  // DCHECK(hard_limit == 0 || soft_limit <= hard_limit);
+  soft_limit_ = soft_limit;
+  hard_limit_ = hard_limit;
+  budget_callback_ = callback;
+  budget_callback_data_ = data;
+  soft_limit_reported_ = 0;
+}
+
 Segment* AccountingAllocator::AllocateSegment(size_t bytes) {
-  void* memory = malloc(bytes);
-  if (memory) {
-    AtomicWorld current =
-      NoBarrier_AtomicIncrement(&current_memory_usage_, bytes);
-    AtomicWorld max = NoBarrier_Load(&max_memory_usage_);
-    while (current > max) {
-      max = NoBarrier_CompareAndSwap(&max_memory_usage_, max, current);
+  // Reserve the bytes up front so that concurrent allocations cannot
+  // overshoot the hard budget together. The increment is only committed if
+  // it stays within the budget, so a rejected request never makes a
+  // concurrent one that fits fail.
+  AtomicWorld old_usage = NoBarrier_Load(&current_memory_usage_);
+  AtomicWorld current;
+  while (true) {
+    current = old_usage + static_cast<AtomicWorld>(bytes);
+    if (hard_limit_ != 0 && static_cast<size_t>(current) > hard_limit_) {
+      return nullptr;
     }
+    AtomicWorld previous =
+      NoBarrier_CompareAndSwap(&current_memory_usage_, old_usage, current);
+    if (previous == old_usage) break;
+    old_usage = previous;
+  }
+
+  void* memory = malloc(bytes);
+  if (memory == nullptr) {
+    NoBarrier_AtomicIncrement(&current_memory_usage_,
+                              -static_cast<AtomicWorld>(bytes));
+    return nullptr;
+  }
+
+  AtomicWorld max = NoBarrier_Load(&max_memory_usage_);
+  while (current > max) {
+    max = NoBarrier_CompareAndSwap(&max_memory_usage_, max, current);
+  }
+
+  // Only the allocation that disarms the soft limit reports it, so the
+  // callback fires once per crossing even under contention. FreeSegment()
+  // re-arms it once the usage has dropped well below the limit.
+  if (soft_limit_ != 0 && static_cast<size_t>(current) > soft_limit_ &&
+      NoBarrier_CompareAndSwap(&soft_limit_reported_, 0, 1) == 0 &&
+      budget_callback_ != nullptr) {
+    budget_callback_("AccountingAllocator", current, soft_limit_,
+                     budget_callback_data_);
   }
   return reinterpret_cast<Segment*>(memory);
 }
@@ -50,9 +104,16 @@ void AccountingAllocator::ReturnSegment(Segment* segment) {
 }
 
 void AccountingAllocator::FreeSegment(Segment* memory) {
-  NoBarrier_AtomicIncrement(&current_memory_usage_, -static_cast<AtomicWorld>(memory->size()));
+  AtomicWorld current =
+    NoBarrier_AtomicIncrement(&current_memory_usage_, -static_cast<AtomicWorld>(memory->size()));
   memory->ZapHeader();
   free(memory);
+
+  // Re-arm the soft limit callback with some hysteresis.
+  if (soft_limit_ != 0 &&
+      static_cast<size_t>(current) < soft_limit_ - soft_limit_ / 4) {
+    NoBarrier_CompareAndSwap(&soft_limit_reported_, 1, 0);
+  }
 }
 
 size_t AccountingAllocator::GetCurrentMemoryUsage() const {
@@ -67,7 +128,33 @@ size_t AccountingAllocator::GetCurrentPoolSize() const {
   return NoBarrier_Load(&current_pool_size_);
 }
 
-Segment* AccountingAllocator::GetSegmentFromPool(size_t requested_size) {
+void AccountingAllocator::GetPoolOccupancy(size_t* counts) {
+  LockGuard<Mutex> lock_guard(&unused_segments_mutex_);
+
+  std::copy(unused_segments_sizes_, unused_segments_sizes_ + kNumberBuckets,
+            counts);
+}
+
+void AccountingAllocator::ZoneCreation(const Zone* zone) {
+  if (trace_sink_ != nullptr) trace_sink_->ZoneCreated(zone);
+}
+
+void AccountingAllocator::ZoneDestruction(const Zone* zone) {
+  if (trace_sink_ != nullptr) trace_sink_->ZoneDestroyed(zone);
+}
+
+void AccountingAllocator::MemoryPressureNotification(
+    MemoryPressureLevel level) {
+  memory_pressure_level_.SetValue(level);
+  if (trace_sink_ != nullptr) trace_sink_->PressureChanged(level);
+
+  if (level != MemoryPressureLevel::kNone) {
+    ClearPool();
+  }
+}
+
+Segment* AccountingAllocator::GetSegmentFromPool(size_t requested_size,
+                                                 size_t max_size) {
   if (requested_size > (1 << kMaxSegmentSizePower)) {
     return nullptr;
   }
@@ -82,10 +169,21 @@ Segment* AccountingAllocator::GetSegmentFromPool(size_t requested_size) {
   {
     LockGuard<Mutex> lock_guard(&unused_segments_mutex_);
 
+    // Segments in a bucket can be up to twice the bucket size; skip the
+    // ones that would not fit the caller's budget.
+    Segment* previous = nullptr;
     segment = unused_segments_heads_[power];
+    while (segment != nullptr && max_size != 0 && segment->size() > max_size) {
+      previous = segment;
+      segment = segment->next();
+    }
 
     if (segment != nullptr) {
-      unused_segments_heads_[power] = segment->next();
+      if (previous == nullptr) {
+        unused_segments_heads_[power] = segment->next();
+      } else {
+        previous->set_next(segment->next());
+      }
       segment->set_next(nullptr);
 
       unused_segments_sizes_[power]--;
@@ -122,7 +220,7 @@ bool AccountingAllocator::AddSegmentToPool(Segment* segment) {
     unused_segments_sizes_[power]++;
   }
 
-  return false;
+  return true;
 }
 
 void AccountingAllocator::ClearPool() {
@@ -132,10 +230,13 @@ void AccountingAllocator::ClearPool() {
     Segment* current = unused_segments_heads_[power];
     while (current) {
       Segment* next = current->next();
+      NoBarrier_AtomicIncrement(&current_pool_size_,
+                                -static_cast<AtomicWorld>(current->size()));
       FreeSegment(current);
       current = next;
     }
     unused_segments_heads_[power] = nullptr;
+    unused_segments_sizes_[power] = 0;
   }
 }
 
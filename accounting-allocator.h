@@ -5,29 +5,81 @@
 #include "mutex.h"
 #include "zone-segment.h"
 
+class ZoneTraceSink;
+
 class AccountingAllocator {
   public:
-    AccountingAllocator();
-    virtual ~AccountingAllocator();
-
-    // Gets an empty segment from the pool or creates a new one.
-    virtual Segment* GetSegment(size_t bytes);
-
-  private:
     static const uint8_t kMinSegmentSizePower = 13;
     static const uint8_t kMaxSegmentSizePower = 18;
     static const size_t kNumberBuckets =
         1 + kMaxSegmentSizePower - kMinSegmentSizePower;
 
-    // Allocates a new segment. Returns nullptr on failed allocation.
-    Segment* AllocateSegment(size_t bytes);
-    void FreeSegment(Segment* memory);
+    AccountingAllocator();
+    virtual ~AccountingAllocator();
+
+    // Gets an empty segment of at least |bytes| from the pool or creates a
+    // new one. Pooled segments can be larger than requested; a non-zero
+    // |max_bytes| skips those larger than |max_bytes|. Returns nullptr if
+    // creating a new segment would exceed the hard memory budget.
+    virtual Segment* GetSegment(size_t bytes, size_t max_bytes);
+
+    // Return unneeded segments to either insert them into the pool or release
+    // them if the pool is already full or memory pressure is high.
+    virtual void ReturnSegment(Segment* memory);
 
     size_t GetCurrentMemoryUsage() const;
     size_t GetMaxMemoryUsage() const;
 
     size_t GetCurrentPoolSize() const;
 
+    // Copies the number of unused segments held in each pool bucket into
+    // |counts|, which must have room for kNumberBuckets entries. Bucket i
+    // holds segments of at least 2^(kMinSegmentSizePower + i) bytes.
+    void GetPoolOccupancy(size_t* counts);
+
+    // Notifications about the lifetime of zones using this allocator.
+    virtual void ZoneCreation(const Zone* zone);
+    virtual void ZoneDestruction(const Zone* zone);
+
+    // Attaches a sink that records zone activity for offline replay, or
+    // detaches it when |sink| is nullptr. The sink must outlive every zone
+    // using this allocator. Not thread-safe; attach before zones are created.
+    void set_trace_sink(ZoneTraceSink* sink) { trace_sink_ = sink; }
+    ZoneTraceSink* trace_sink() const { return trace_sink_; }
+
+    // Records the current memory pressure level. Any level above kNone
+    // stops pooling of returned segments and empties the pool.
+    void MemoryPressureNotification(MemoryPressureLevel level);
+
+    // Sets the memory budgets on the bytes held by this allocator, pooled
+    // segments included. A limit of 0 disables the respective check. The
+    // |callback| is invoked with |data| when the usage crosses |soft_limit|;
+    // it is re-armed only after the usage has dropped below three quarters
+    // of |soft_limit|, so trimming the pool from the callback does not cause
+    // it to fire on every allocation near the limit. When an allocation
+    // would exceed |hard_limit| the pool is cleared and the allocation
+    // retried once before it fails.
+    // Not thread-safe; configure before the allocator is shared.
+    void SetMemoryBudget(size_t soft_limit, size_t hard_limit,
+                         MemoryBudgetCallback callback, void* data);
+
+    size_t hard_limit() const { return hard_limit_; }
+
+  private:
+    // Maximum number of unused segments kept per size bucket.
+    static const size_t kDefaultBucketMaxSize = 5;
+
+    // Allocates a new segment. Returns nullptr on failed allocation.
+    Segment* AllocateSegment(size_t bytes);
+    void FreeSegment(Segment* memory);
+
+    // Takes a pooled segment of at least |requested_size| bytes and, if
+    // |max_size| is non-zero, at most |max_size| bytes. Returns nullptr if
+    // there is none.
+    Segment* GetSegmentFromPool(size_t requested_size, size_t max_size);
+    // Returns false if the segment could not be pooled and must be freed.
+    bool AddSegmentToPool(Segment* segment);
+
     AtomicValue<MemoryPressureLvel> memory_pressure_level_;
     Mutex unused_segments_mutex_;
 
@@ -35,6 +87,16 @@ class AccountingAllocator {
     AtomicWorld max_memory_usage_ = 0;
     AtomicWorld current_pool_size_ = 0;
 
+    // Memory budgets on current_memory_usage_; 0 means unlimited.
+    size_t soft_limit_ = 0;
+    size_t hard_limit_ = 0;
+    MemoryBudgetCallback budget_callback_ = nullptr;
+    void* budget_callback_data_ = nullptr;
+    // Set while the soft limit callback is disarmed (0 or 1).
+    AtomicWorld soft_limit_reported_ = 0;
+
+    ZoneTraceSink* trace_sink_ = nullptr;
+
     // Empties the pool and puts all its contents onto the garbage stack.
     void ClearPool();
 
@@ -29,6 +29,17 @@ using Address = byte*;
  */
 enum class MemoryPressureLevel: std::uint8_t { kNone, kModerate, kCritical };
 
+/**
+ * Callback invoked when a memory budget is crossed. |name| identifies the
+ * owner of the budget (the zone name, or "AccountingAllocator"), |usage| is
+ * the number of bytes held after the allocation that crossed the limit, and
+ * |data| is the opaque pointer registered together with the callback.
+ * The callback may shed load or trim pools, but must not allocate from the
+ * owner that invoked it.
+ */
+using MemoryBudgetCallback = void (*)(const char* name, size_t usage,
+                                      size_t limit, void* data);
+
 // Use AtomicWord for a machine-sized pointer. It will use the Atomic32 or
 // Atomic64 routines below, depending on you architecture.
 using AtomicWorld = intptr_t;
@@ -58,6 +69,16 @@ inline Atomic64 NoBarrier_Load(volatile const Atomic64* ptr) {
   return __atomic_load_n(ptr, __ATOMIC_RELAXED);
 }
 
+// Atomically stores new_value into *ptr if *ptr equals old_value.
+// Always returns the value *ptr had before the operation.
+inline Atomic64 NoBarrier_CompareAndSwap(volatile Atomic64* ptr,
+                                         Atomic64 old_value,
+                                         Atomic64 new_value) {
+  __atomic_compare_exchange_n(ptr, &old_value, new_value, false,
+                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+  return old_value;
+}
+
 // Compute the 0-relative offset of some absolute value x of type T.
 // This allows conversion of Addresses and integral types into
 // 0-relative int offsets.
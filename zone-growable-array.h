@@ -0,0 +1,126 @@
+#ifndef ZONE_GROWABLE_ARRAY_H_
+#define ZONE_GROWABLE_ARRAY_H_
+
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include "globals.h"
+#include "zone.h"
+
+// ----------------------------------------------------------------------------
+// ZoneGrowableArray
+//
+// A growable array whose backing store lives in a Zone. When the array runs
+// out of capacity it first tries to extend its backing store in place with
+// Zone::TryExtend(), which succeeds as long as nothing else has been
+// allocated in the zone since the last growth. Otherwise it allocates a new
+// backing store of geometrically increasing size and copies the elements;
+// the old store is only reclaimed when the zone dies.
+//
+// Elements are moved with memcpy and never destroyed, so T must be
+// trivially copyable and trivially destructible.
+
+template <typename T>
+class ZoneGrowableArray final {
+  static_assert(std::is_trivially_copyable<T>::value &&
+                    std::is_trivially_destructible<T>::value,
+                "ZoneGrowableArray elements are memcpy'd and never destroyed");
+
+  public:
+    ZoneGrowableArray(int capacity, Zone* zone)
+        : data_(nullptr), length_(0), capacity_(0), zone_(zone) {
+      // DCHECK_GE(capacity, 0);
+      if (capacity > 0 && FitsInZone(capacity)) {
+        data_ = static_cast<T*>(zone_->New(capacity * sizeof(T)));
+        if (data_ != nullptr) capacity_ = capacity;
+      }
+    }
+
+    int length() const { return length_; }
+    int capacity() const { return capacity_; }
+    bool is_empty() const { return length_ == 0; }
+
+    T& operator[](int i) const {
+      // DCHECK(0 <= i && i < length_);
+      return data_[i];
+    }
+    T& at(int i) const { return operator[](i); }
+    T& first() const { return at(0); }
+    T& last() const { return at(length_ - 1); }
+
+    T* begin() const { return data_; }
+    T* end() const { return data_ + length_; }
+
+    // Appends 'element' to the end of the array, growing the backing store
+    // if necessary. Returns false if the zone could not provide the memory.
+    bool Add(const T& element) {
+      if (length_ == capacity_) {
+        int new_capacity;
+        if (!NextCapacity(capacity_, &new_capacity) || !Grow(new_capacity)) {
+          return false;
+        }
+      }
+      data_[length_++] = element;
+      return true;
+    }
+
+    // Makes sure there is room for at least 'capacity' elements.
+    bool Reserve(int capacity) {
+      if (capacity <= capacity_) return true;
+      return Grow(capacity);
+    }
+
+    // Truncates the array to its first 'pos' elements, keeping the backing
+    // store for reuse.
+    void Rewind(int pos) {
+      // DCHECK(0 <= pos && pos <= length_);
+      length_ = pos;
+    }
+    // Drops all elements but keeps the backing store for reuse.
+    void Clear() { Rewind(0); }
+
+  private:
+    // Computes the geometrically grown capacity. Returns false if it does
+    // not fit in an int.
+    static bool NextCapacity(int capacity, int* result) {
+      if (capacity > (std::numeric_limits<int>::max() - 1) / 2) return false;
+      *result = 1 + 2 * capacity;
+      return true;
+    }
+
+    // Returns true if 'capacity' elements can be sized without overflow.
+    static bool FitsInZone(int capacity) {
+      return static_cast<size_t>(capacity) <=
+             std::numeric_limits<size_t>::max() / sizeof(T);
+    }
+
+    bool Grow(int new_capacity) {
+      // DCHECK_GT(new_capacity, capacity_);
+      if (!FitsInZone(new_capacity)) return false;
+      const size_t old_size = capacity_ * sizeof(T);
+      const size_t new_size = new_capacity * sizeof(T);
+
+      // Fast path: the backing store is the last allocation in the zone.
+      if (data_ != nullptr && zone_->TryExtend(data_, old_size, new_size)) {
+        capacity_ = new_capacity;
+        return true;
+      }
+
+      T* new_data = static_cast<T*>(zone_->New(new_size));
+      if (new_data == nullptr) return false;
+      if (length_ > 0) memcpy(new_data, data_, length_ * sizeof(T));
+      data_ = new_data;
+      capacity_ = new_capacity;
+      return true;
+    }
+
+    T* data_;
+    int length_;
+    int capacity_;
+    Zone* zone_;
+
+    DISALLOW_COPY_AND_ASSIGN(ZoneGrowableArray);
+};
+
+#endif // #ifndef ZONE_GROWABLE_ARRAY_H_
@@ -0,0 +1,661 @@
+// Multi-threaded churn and fragmentation stress harness for Zone and
+// AccountingAllocator.
+//
+// Workloads are described by replayable trace files so that an allocation
+// trace captured in production can be replayed offline against different
+// allocator builds. A trace is plain text, one operation per line:
+//
+//   # comment
+//   create   <thread> <zone>
+//   alloc    <thread> <zone> <bytes> [<repeat>]
+//   destroy  <thread> <zone>
+//   pressure <thread> none|moderate|critical
+//
+// Lines appear in the global order in which the operations happened. Zone
+// ids are unique within a trace and a zone is only used by the thread that
+// created it; traces violating this are rejected. Every thread replays its
+// own create/alloc/destroy operations in trace order; zones still alive at
+// the end of a thread are destroyed by that thread. Pressure changes are not
+// bound to a replay thread: each one is applied once every thread has
+// finished the operations preceding it in the trace, and threads hold
+// back operations following it until it has been applied.
+//
+// Production traces are captured by attaching a ZoneTraceSink (see
+// zone-trace.h) to the AccountingAllocator of a build compiled with
+// ZONE_ALLOCATION_TRACE defined.
+//
+// Usage:
+//   zone-stress --generate <trace> [--threads N] [--ops N] [--seed S]
+//   zone-stress <trace> [--sample-ms M]
+//
+// The replay reports throughput, the latency distribution of GetSegment()
+// and ReturnSegment(), and a time series of RSS against the allocator's
+// GetCurrentMemoryUsage(), GetMaxMemoryUsage() and GetCurrentPoolSize(),
+// together with zone fragmentation (bytes requested from live zones against
+// the segment bytes they hold) and the number of segments in each pool
+// bucket.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "accounting-allocator.h"
+#include "zone.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+enum class OpKind : uint8_t { kCreate, kAlloc, kDestroy, kPressure };
+
+struct TraceOp {
+  OpKind kind;
+  int zone;
+  size_t bytes;
+  int repeat;
+  MemoryPressureLevel level;
+  // Position of the operation in the trace.
+  uint64_t sequence;
+  // Number of pressure changes that precede the operation in the trace.
+  size_t pressure_before;
+};
+
+struct Trace {
+  std::vector<std::vector<TraceOp>> threads;
+  std::vector<TraceOp> pressure;
+};
+
+// Largest single allocation accepted from a trace. Anything bigger is taken
+// to be a corrupt trace rather than a workload.
+const long long kMaxTraceAllocation = 256 * MB;
+
+// Largest thread id accepted from a trace; every id up to the largest one
+// used becomes a replay thread.
+const int kMaxTraceThread = 1023;
+
+const char* PressureName(MemoryPressureLevel level) {
+  switch (level) {
+    case MemoryPressureLevel::kNone:
+      return "none";
+    case MemoryPressureLevel::kModerate:
+      return "moderate";
+    case MemoryPressureLevel::kCritical:
+      return "critical";
+  }
+  return "none";
+}
+
+bool ParsePressure(const std::string& name, MemoryPressureLevel* level) {
+  if (name == "none") {
+    *level = MemoryPressureLevel::kNone;
+  } else if (name == "moderate") {
+    *level = MemoryPressureLevel::kModerate;
+  } else if (name == "critical") {
+    *level = MemoryPressureLevel::kCritical;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Parses |path| into per-thread operation lists. Returns false and prints
+// the offending line on malformed input.
+bool ReadTrace(const char* path, Trace* trace) {
+  std::ifstream in(path);
+  if (!in) {
+    fprintf(stderr, "zone-stress: cannot open trace %s\n", path);
+    return false;
+  }
+
+  // Owning thread and liveness of every zone id seen so far.
+  struct ZoneState {
+    int thread;
+    bool destroyed;
+  };
+  std::unordered_map<int, ZoneState> zones;
+
+  std::string line;
+  int line_number = 0;
+  uint64_t sequence = 0;
+  while (std::getline(in, line)) {
+    line_number++;
+    if (line.empty() || line[0] == '#') continue;
+
+    std::istringstream fields(line);
+    std::string op;
+    int thread = -1;
+    fields >> op >> thread;
+
+    TraceOp entry = {OpKind::kAlloc, -1, 0, 1, MemoryPressureLevel::kNone,
+                     sequence, trace->pressure.size()};
+    bool ok = !fields.fail() && thread >= 0;
+    if (ok && op == "create") {
+      entry.kind = OpKind::kCreate;
+      ok = static_cast<bool>(fields >> entry.zone);
+    } else if (ok && op == "destroy") {
+      entry.kind = OpKind::kDestroy;
+      ok = static_cast<bool>(fields >> entry.zone);
+    } else if (ok && op == "alloc") {
+      long long bytes = -1;
+      entry.kind = OpKind::kAlloc;
+      ok = static_cast<bool>(fields >> entry.zone >> bytes) && bytes >= 0 &&
+           bytes <= kMaxTraceAllocation;
+      entry.bytes = static_cast<size_t>(bytes);
+      if (ok && !(fields >> entry.repeat)) entry.repeat = 1;
+      ok = ok && entry.repeat > 0;
+    } else if (ok && op == "pressure") {
+      std::string level;
+      entry.kind = OpKind::kPressure;
+      ok = (fields >> level) && ParsePressure(level, &entry.level);
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      fprintf(stderr, "zone-stress: %s:%d: malformed line '%s'\n", path,
+              line_number, line.c_str());
+      return false;
+    }
+
+    const char* error = nullptr;
+    if (thread > kMaxTraceThread) {
+      error = "thread id out of range";
+    } else if (entry.kind == OpKind::kCreate) {
+      if (!zones.emplace(entry.zone, ZoneState{thread, false}).second) {
+        error = "zone created twice";
+      }
+    } else if (entry.kind != OpKind::kPressure) {
+      auto it = zones.find(entry.zone);
+      if (it == zones.end()) {
+        error = "zone used before it was created";
+      } else if (it->second.thread != thread) {
+        error = "zone used by a thread other than its creator";
+      } else if (it->second.destroyed) {
+        error = "zone used after it was destroyed";
+      } else if (entry.kind == OpKind::kDestroy) {
+        it->second.destroyed = true;
+      }
+    }
+    if (error != nullptr) {
+      fprintf(stderr, "zone-stress: %s:%d: %s in '%s'\n", path, line_number,
+              error, line.c_str());
+      return false;
+    }
+
+    sequence++;
+    if (entry.kind == OpKind::kPressure) {
+      trace->pressure.push_back(entry);
+      continue;
+    }
+    if (static_cast<size_t>(thread) >= trace->threads.size()) {
+      trace->threads.resize(thread + 1);
+    }
+    trace->threads[thread].push_back(entry);
+  }
+  return true;
+}
+
+// Writes a synthetic trace modelled on the production pattern: most zones
+// are short-lived and hold a handful of small objects, a few live for most
+// of the run and grow large. Sizes are log-uniform between 8 bytes and
+// 1 KB with an occasional large (4 KB - 256 KB) allocation. The output
+// only depends on the arguments, so a seed identifies a workload.
+bool GenerateTrace(const char* path, int threads, int ops_per_thread,
+                   uint64_t seed) {
+  FILE* out = fopen(path, "w");
+  if (out == nullptr) {
+    fprintf(stderr, "zone-stress: cannot write trace %s\n", path);
+    return false;
+  }
+
+  fprintf(out, "# zone-stress trace v1\n");
+  fprintf(out, "# threads=%d ops=%d seed=%llu\n", threads, ops_per_thread,
+          static_cast<unsigned long long>(seed));
+
+  std::mt19937_64 rng(seed);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+  const int kMaxLiveZones = 16;
+  int next_zone = 0;
+
+  struct LiveZone {
+    int id;
+    int remaining_ops;
+  };
+  std::vector<std::vector<LiveZone>> live(threads);
+
+  // Interleave the threads round-robin so that the trace order, which the
+  // replay uses to place pressure changes, resembles a concurrent capture.
+  for (int i = 0; i < ops_per_thread; i++) {
+    for (int thread = 0; thread < threads; thread++) {
+      std::vector<LiveZone>& zones = live[thread];
+      if (zones.empty() ||
+          (static_cast<int>(zones.size()) < kMaxLiveZones &&
+           unit(rng) < 0.05)) {
+        // 90% short-lived zones, 10% long-lived ones.
+        int lifetime = unit(rng) < 0.9
+                           ? 16 + static_cast<int>(unit(rng) * 256)
+                           : ops_per_thread / 2 +
+                                 static_cast<int>(unit(rng) * ops_per_thread);
+        zones.push_back({next_zone, lifetime});
+        fprintf(out, "create %d %d\n", thread, next_zone);
+        next_zone++;
+        continue;
+      }
+
+      if (thread == 0 && unit(rng) < 0.001) {
+        MemoryPressureLevel level =
+            static_cast<MemoryPressureLevel>(static_cast<int>(unit(rng) * 3));
+        fprintf(out, "pressure %d %s\n", thread, PressureName(level));
+        continue;
+      }
+
+      size_t index = static_cast<size_t>(unit(rng) * zones.size());
+      LiveZone& zone = zones[index];
+      size_t bytes;
+      if (unit(rng) < 0.02) {
+        bytes = static_cast<size_t>(4 * KB * std::pow(64.0, unit(rng)));
+      } else {
+        bytes = static_cast<size_t>(8 * std::pow(128.0, unit(rng)));
+      }
+      int repeat = 1 + static_cast<int>(unit(rng) * 8);
+      fprintf(out, "alloc %d %d %zu %d\n", thread, zone.id, bytes, repeat);
+
+      if (--zone.remaining_ops <= 0) {
+        fprintf(out, "destroy %d %d\n", thread, zone.id);
+        zones[index] = zones.back();
+        zones.pop_back();
+      }
+    }
+  }
+
+  for (int thread = 0; thread < threads; thread++) {
+    for (const LiveZone& zone : live[thread]) {
+      fprintf(out, "destroy %d %d\n", thread, zone.id);
+    }
+  }
+
+  fclose(out);
+  return true;
+}
+
+// Per-thread latency samples in nanoseconds. Each replay thread owns one,
+// so recording never takes a lock.
+struct LatencyRecorder {
+  std::vector<uint64_t> get_segment;
+  std::vector<uint64_t> return_segment;
+};
+
+thread_local LatencyRecorder* current_recorder = nullptr;
+
+uint64_t ElapsedNanos(Clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                              start)
+      .count();
+}
+
+// Allocator that times every segment request and return made by a replay
+// thread.
+class InstrumentedAllocator final : public AccountingAllocator {
+  public:
+    InstrumentedAllocator() = default;
+
+    Segment* GetSegment(size_t bytes, size_t max_bytes) override {
+      Clock::time_point start = Clock::now();
+      Segment* result = AccountingAllocator::GetSegment(bytes, max_bytes);
+      if (current_recorder != nullptr) {
+        current_recorder->get_segment.push_back(ElapsedNanos(start));
+      }
+      return result;
+    }
+
+    void ReturnSegment(Segment* segment) override {
+      Clock::time_point start = Clock::now();
+      AccountingAllocator::ReturnSegment(segment);
+      if (current_recorder != nullptr) {
+        current_recorder->return_segment.push_back(ElapsedNanos(start));
+      }
+    }
+
+  private:
+    DISALLOW_COPY_AND_ASSIGN(InstrumentedAllocator);
+};
+
+// Bytes requested from and segment bytes held by all live zones, updated by
+// the replay threads and read by the sampler.
+struct ZoneUsage {
+  std::atomic<int64_t> requested{0};
+  std::atomic<int64_t> held{0};
+};
+
+// Places the trace's pressure changes between the replay threads' operations.
+struct PressureSchedule {
+  explicit PressureSchedule(int thread_count)
+      : next(new std::atomic<uint64_t>[thread_count]), applied(0) {
+    for (int i = 0; i < thread_count; i++) next[i].store(0);
+  }
+
+  // Sequence number of the operation each replay thread is about to run,
+  // or kDone once it has run all of them.
+  std::unique_ptr<std::atomic<uint64_t>[]> next;
+  // Number of pressure changes applied so far.
+  std::atomic<size_t> applied;
+
+  static const uint64_t kDone = std::numeric_limits<uint64_t>::max();
+};
+
+struct ThreadResult {
+  LatencyRecorder latencies;
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+  uint64_t failed_allocations = 0;
+};
+
+void ReplayThread(int index, const std::vector<TraceOp>& ops,
+                  AccountingAllocator* allocator, ZoneUsage* usage,
+                  PressureSchedule* schedule, std::atomic<int>* ready,
+                  int thread_count, ThreadResult* result) {
+  current_recorder = &result->latencies;
+  std::unordered_map<int, Zone*> zones;
+
+  // Start all threads together so the contention pattern is reproducible.
+  ready->fetch_add(1);
+  while (ready->load() < thread_count) std::this_thread::yield();
+
+  for (const TraceOp& op : ops) {
+    // Hold back until the pressure changes preceding this operation in the
+    // trace have been applied.
+    schedule->next[index].store(op.sequence);
+    while (schedule->applied.load() < op.pressure_before) {
+      std::this_thread::yield();
+    }
+
+    switch (op.kind) {
+      case OpKind::kCreate:
+        zones[op.zone] = new Zone(allocator, "zone-stress");
+        break;
+      case OpKind::kDestroy: {
+        // ReadTrace() guarantees the zone exists and belongs to this thread.
+        Zone* zone = zones[op.zone];
+        usage->requested -= static_cast<int64_t>(zone->allocation_size());
+        usage->held -= static_cast<int64_t>(zone->segment_bytes_allocated());
+        delete zone;
+        zones.erase(op.zone);
+        break;
+      }
+      case OpKind::kAlloc: {
+        Zone* zone = zones[op.zone];
+        const size_t requested_before = zone->allocation_size();
+        const size_t held_before = zone->segment_bytes_allocated();
+        for (int i = 0; i < op.repeat; i++) {
+          void* memory = zone->New(op.bytes);
+          if (memory == nullptr) {
+            result->failed_allocations++;
+            continue;
+          }
+          // Touch the memory so RSS reflects what the zone handed out.
+          memset(memory, 0, op.bytes);
+          result->allocations++;
+          result->bytes += op.bytes;
+        }
+        usage->requested +=
+            static_cast<int64_t>(zone->allocation_size() - requested_before);
+        usage->held +=
+            static_cast<int64_t>(zone->segment_bytes_allocated() - held_before);
+        break;
+      }
+      case OpKind::kPressure:
+        // Applied by ApplyPressureChanges().
+        break;
+    }
+  }
+  schedule->next[index].store(PressureSchedule::kDone);
+
+  for (auto& entry : zones) {
+    Zone* zone = entry.second;
+    usage->requested -= static_cast<int64_t>(zone->allocation_size());
+    usage->held -= static_cast<int64_t>(zone->segment_bytes_allocated());
+    delete zone;
+  }
+  current_recorder = nullptr;
+}
+
+size_t ResidentSetSize() {
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr) return 0;
+  unsigned long size = 0;
+  unsigned long resident = 0;
+  int fields = fscanf(statm, "%lu %lu", &size, &resident);
+  fclose(statm);
+  if (fields != 2) return 0;
+  return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+struct Sample {
+  double seconds;
+  size_t rss;
+  size_t current;
+  size_t max;
+  size_t pool;
+  int64_t requested;
+  int64_t held;
+  size_t buckets[AccountingAllocator::kNumberBuckets];
+};
+
+Sample TakeSample(double seconds, InstrumentedAllocator* allocator,
+                  const ZoneUsage& usage) {
+  Sample sample;
+  sample.seconds = seconds;
+  sample.rss = ResidentSetSize();
+  sample.current = allocator->GetCurrentMemoryUsage();
+  sample.max = allocator->GetMaxMemoryUsage();
+  sample.pool = allocator->GetCurrentPoolSize();
+  sample.requested = usage.requested.load();
+  sample.held = usage.held.load();
+  allocator->GetPoolOccupancy(sample.buckets);
+  return sample;
+}
+
+// Fraction of segment bytes held by live zones that was not handed out.
+double Fragmentation(const Sample& sample) {
+  if (sample.held <= 0) return 0.0;
+  return 1.0 - static_cast<double>(sample.requested) / sample.held;
+}
+
+void PrintSample(const char* label, const Sample& sample) {
+  printf("%10s %12zu %12zu %12zu %12zu %12lld %12lld %7.1f%% ", label,
+         sample.rss, sample.current, sample.max, sample.pool,
+         static_cast<long long>(sample.requested),
+         static_cast<long long>(sample.held), 100.0 * Fragmentation(sample));
+  for (size_t i = 0; i < AccountingAllocator::kNumberBuckets; i++) {
+    printf("%s%zu", i == 0 ? "" : "/", sample.buckets[i]);
+  }
+  printf("\n");
+}
+
+uint64_t Percentile(const std::vector<uint64_t>& sorted, double fraction) {
+  if (sorted.empty()) return 0;
+  size_t index = static_cast<size_t>(fraction * (sorted.size() - 1));
+  return sorted[index];
+}
+
+void PrintLatencies(const char* name, std::vector<uint64_t>* samples) {
+  std::sort(samples->begin(), samples->end());
+  printf("%-15s count=%zu p50=%lluns p99=%lluns p99.9=%lluns max=%lluns\n",
+         name, samples->size(),
+         static_cast<unsigned long long>(Percentile(*samples, 0.5)),
+         static_cast<unsigned long long>(Percentile(*samples, 0.99)),
+         static_cast<unsigned long long>(Percentile(*samples, 0.999)),
+         static_cast<unsigned long long>(
+             samples->empty() ? 0 : samples->back()));
+}
+
+// Applies each pressure change once every replay thread has finished the
+// operations preceding it in the trace.
+void ApplyPressureChanges(const std::vector<TraceOp>& pressure,
+                          int thread_count, AccountingAllocator* allocator,
+                          PressureSchedule* schedule) {
+  for (size_t k = 0; k < pressure.size(); k++) {
+    const TraceOp& op = pressure[k];
+    for (int i = 0; i < thread_count; i++) {
+      while (schedule->next[i].load() < op.sequence) {
+        std::this_thread::yield();
+      }
+    }
+    allocator->MemoryPressureNotification(op.level);
+    schedule->applied.store(k + 1);
+  }
+}
+
+int Replay(const char* path, int sample_ms) {
+  Trace trace;
+  if (!ReadTrace(path, &trace)) return 1;
+  const int thread_count = static_cast<int>(trace.threads.size());
+  if (thread_count == 0) {
+    fprintf(stderr, "zone-stress: trace %s is empty\n", path);
+    return 1;
+  }
+
+  InstrumentedAllocator allocator;
+  ZoneUsage usage;
+  PressureSchedule schedule(thread_count);
+  std::vector<ThreadResult> results(thread_count);
+  std::vector<Sample> samples;
+  std::atomic<bool> done(false);
+  std::atomic<int> ready(0);
+
+  Clock::time_point start = Clock::now();
+  std::thread sampler([&]() {
+    while (!done.load()) {
+      double seconds =
+          std::chrono::duration<double>(Clock::now() - start).count();
+      samples.push_back(TakeSample(seconds, &allocator, usage));
+      std::this_thread::sleep_for(std::chrono::milliseconds(sample_ms));
+    }
+  });
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thread_count; i++) {
+    threads.emplace_back(ReplayThread, i, std::cref(trace.threads[i]),
+                         &allocator, &usage, &schedule, &ready, thread_count,
+                         &results[i]);
+  }
+  ApplyPressureChanges(trace.pressure, thread_count, &allocator, &schedule);
+  for (std::thread& thread : threads) thread.join();
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  done.store(true);
+  sampler.join();
+
+  LatencyRecorder merged;
+  uint64_t allocations = 0;
+  uint64_t bytes = 0;
+  uint64_t failed = 0;
+  for (ThreadResult& result : results) {
+    merged.get_segment.insert(merged.get_segment.end(),
+                              result.latencies.get_segment.begin(),
+                              result.latencies.get_segment.end());
+    merged.return_segment.insert(merged.return_segment.end(),
+                                 result.latencies.return_segment.begin(),
+                                 result.latencies.return_segment.end());
+    allocations += result.allocations;
+    bytes += result.bytes;
+    failed += result.failed_allocations;
+  }
+
+  printf("trace           %s\n", path);
+  printf("threads         %d\n", thread_count);
+  printf("pressure        %zu changes\n", trace.pressure.size());
+  printf("elapsed         %.3fs\n", elapsed);
+  printf("allocations     %llu (%.0f/s, %llu failed)\n",
+         static_cast<unsigned long long>(allocations), allocations / elapsed,
+         static_cast<unsigned long long>(failed));
+  printf("bytes           %llu (%.1f MB/s)\n",
+         static_cast<unsigned long long>(bytes), bytes / elapsed / MB);
+  PrintLatencies("GetSegment", &merged.get_segment);
+  PrintLatencies("ReturnSegment", &merged.return_segment);
+
+  double peak_fragmentation = 0.0;
+  printf("\n%10s %12s %12s %12s %12s %12s %12s %8s %s\n", "time(s)", "rss",
+         "current", "max", "pool", "requested", "held", "frag",
+         "pool segments per bucket (8K..256K)");
+  for (const Sample& sample : samples) {
+    char label[32];
+    snprintf(label, sizeof(label), "%.3f", sample.seconds);
+    PrintSample(label, sample);
+    peak_fragmentation = std::max(peak_fragmentation, Fragmentation(sample));
+  }
+  PrintSample("end", TakeSample(elapsed, &allocator, usage));
+  printf("peak fragmentation %.1f%%\n", 100.0 * peak_fragmentation);
+  return 0;
+}
+
+void PrintUsage() {
+  fprintf(stderr,
+          "usage: zone-stress --generate <trace> [--threads N] [--ops N] "
+          "[--seed S]\n"
+          "       zone-stress <trace> [--sample-ms M]\n");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    PrintUsage();
+    return 1;
+  }
+
+  const char* generate = nullptr;
+  const char* trace = nullptr;
+  int threads = 8;
+  int ops = 100000;
+  uint64_t seed = 1;
+  int sample_ms = 10;
+
+  for (int i = 1; i < argc; i++) {
+    bool has_value = i + 1 < argc;
+    if (strcmp(argv[i], "--generate") == 0 && has_value) {
+      generate = argv[++i];
+    } else if (strcmp(argv[i], "--threads") == 0 && has_value) {
+      threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--ops") == 0 && has_value) {
+      ops = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--seed") == 0 && has_value) {
+      seed = strtoull(argv[++i], nullptr, 10);
+    } else if (strcmp(argv[i], "--sample-ms") == 0 && has_value) {
+      sample_ms = atoi(argv[++i]);
+    } else if (argv[i][0] != '-' && trace == nullptr) {
+      trace = argv[i];
+    } else {
+      PrintUsage();
+      return 1;
+    }
+  }
+
+  if (generate != nullptr) {
+    if (threads <= 0 || ops <= 0) {
+      PrintUsage();
+      return 1;
+    }
+    return GenerateTrace(generate, threads, ops, seed) ? 0 : 1;
+  }
+  if (trace == nullptr || sample_ms <= 0) {
+    PrintUsage();
+    return 1;
+  }
+  return Replay(trace, sample_ms);
+}
@@ -0,0 +1,87 @@
+#include "zone-trace.h"
+
+ZoneTraceSink::ZoneTraceSink(FILE* out)
+    : mutex_(),
+      out_(out),
+      next_zone_id_(0),
+      pending_thread_(-1),
+      pending_zone_(-1),
+      pending_bytes_(0),
+      pending_repeat_(0) {
+  fprintf(out_, "# zone-stress trace v1\n");
+}
+
+ZoneTraceSink::~ZoneTraceSink() {
+  LockGuard<Mutex> lock_guard(&mutex_);
+  FlushPendingAlloc();
+  fflush(out_);
+}
+
+void ZoneTraceSink::ZoneCreated(const Zone* zone) {
+  LockGuard<Mutex> lock_guard(&mutex_);
+  LookupZone(zone);
+}
+
+void ZoneTraceSink::ZoneAllocated(const Zone* zone, size_t bytes) {
+  LockGuard<Mutex> lock_guard(&mutex_);
+  const ZoneEntry& entry = LookupZone(zone);
+
+  if (pending_repeat_ > 0 && pending_zone_ == entry.id &&
+      pending_bytes_ == bytes) {
+    pending_repeat_++;
+    return;
+  }
+
+  FlushPendingAlloc();
+  pending_thread_ = entry.thread;
+  pending_zone_ = entry.id;
+  pending_bytes_ = bytes;
+  pending_repeat_ = 1;
+}
+
+void ZoneTraceSink::ZoneDestroyed(const Zone* zone) {
+  LockGuard<Mutex> lock_guard(&mutex_);
+  auto it = zones_.find(zone);
+  // Zones that were never seen by the sink have nothing to replay.
+  if (it == zones_.end()) return;
+
+  FlushPendingAlloc();
+  fprintf(out_, "destroy %d %d\n", it->second.thread, it->second.id);
+  zones_.erase(it);
+}
+
+void ZoneTraceSink::PressureChanged(MemoryPressureLevel level) {
+  LockGuard<Mutex> lock_guard(&mutex_);
+  const char* name = "none";
+  if (level == MemoryPressureLevel::kModerate) {
+    name = "moderate";
+  } else if (level == MemoryPressureLevel::kCritical) {
+    name = "critical";
+  }
+
+  FlushPendingAlloc();
+  fprintf(out_, "pressure %d %s\n", CurrentThreadId(), name);
+}
+
+int ZoneTraceSink::CurrentThreadId() {
+  auto result = threads_.emplace(std::this_thread::get_id(),
+                                 static_cast<int>(threads_.size()));
+  return result.first->second;
+}
+
+const ZoneTraceSink::ZoneEntry& ZoneTraceSink::LookupZone(const Zone* zone) {
+  auto it = zones_.find(zone);
+  if (it != zones_.end()) return it->second;
+
+  ZoneEntry entry = {next_zone_id_++, CurrentThreadId()};
+  FlushPendingAlloc();
+  fprintf(out_, "create %d %d\n", entry.thread, entry.id);
+  return zones_.emplace(zone, entry).first->second;
+}
+
+void ZoneTraceSink::FlushPendingAlloc() {
+  if (pending_repeat_ == 0) return;
+  fprintf(out_, "alloc %d %d %zu %d\n", pending_thread_, pending_zone_,
+          pending_bytes_, pending_repeat_);
+  pending_repeat_ = 0;
+}
@@ -0,0 +1,76 @@
+#ifndef ZONE_TRACE_H_
+#define ZONE_TRACE_H_
+
+#include <cstdio>
+#include <thread>
+#include <unordered_map>
+
+#include "globals.h"
+#include "mutex.h"
+
+class Zone;
+
+// ----------------------------------------------------------------------------
+// ZoneTraceSink
+//
+// Records zone activity in the plain text trace format replayed by
+// zone-stress, so that a production allocation trace can be captured and
+// replayed offline against different allocator builds. Attach a sink with
+// AccountingAllocator::set_trace_sink(). Zone creation, destruction and
+// memory pressure changes are always reported; individual allocations are
+// only reported when the build defines ZONE_ALLOCATION_TRACE, which keeps
+// the bump pointer fast path in Zone::New() free of any check otherwise.
+//
+// Lines are written in the global order in which the operations happened,
+// which the replay uses to apply pressure changes at the right point.
+// Threads and zones are numbered densely in order of first appearance.
+// Every operation on a zone is attributed to the thread that created it, so
+// zones handed to another thread replay on their creator. Zones first seen
+// after the sink was attached get a create line on their first use.
+// In-place growth through Zone::TryExtend() is recorded as an allocation of
+// the added bytes.
+
+class ZoneTraceSink final {
+  public:
+    // Writes the trace to |out|, which must stay open for the lifetime of
+    // the sink.
+    explicit ZoneTraceSink(FILE* out);
+    ~ZoneTraceSink();
+
+    void ZoneCreated(const Zone* zone);
+    void ZoneAllocated(const Zone* zone, size_t bytes);
+    void ZoneDestroyed(const Zone* zone);
+    void PressureChanged(MemoryPressureLevel level);
+
+  private:
+    // Trace ids of a zone and of the thread that created it.
+    struct ZoneEntry {
+      int id;
+      int thread;
+    };
+
+    // The helpers below expect mutex_ to be held.
+    int CurrentThreadId();
+    // Returns the entry for |zone|, emitting a create line attributed to the
+    // calling thread the first time the zone is seen.
+    const ZoneEntry& LookupZone(const Zone* zone);
+    void FlushPendingAlloc();
+
+    Mutex mutex_;
+    FILE* out_;
+
+    std::unordered_map<std::thread::id, int> threads_;
+    std::unordered_map<const Zone*, ZoneEntry> zones_;
+    int next_zone_id_;
+
+    // Consecutive identical allocations are folded into a single line with
+    // a repeat count.
+    int pending_thread_;
+    int pending_zone_;
+    size_t pending_bytes_;
+    int pending_repeat_;
+
+    DISALLOW_COPY_AND_ASSIGN(ZoneTraceSink);
+};
+
+#endif // #ifndef ZONE_TRACE_H_
@@ -1,5 +1,10 @@
 #include "zone.h"
 
+#include <cstdio>
+
+#include "accounting-allocator.h"
+#include "zone-trace.h"
+
 #define ASAN_POSITION_MEMORY_REGION(start, size) \
   do {                                           \
     USE(start);                                  \
@@ -15,6 +20,11 @@
 Zone::Zone(AccountingAllocator* allocator, const char* name)
     : allocation_size_(0),
       segment_bytes_allocated_(0),
+      soft_limit_(kExcessLimit),
+      hard_limit_(0),
+      soft_limit_reported_(false),
+      budget_callback_(nullptr),
+      budget_callback_data_(nullptr),
       position_(0),
       limit_(0),
       allocator_(allocator),
@@ -48,9 +58,32 @@ void Zone::DeleteAll() {
   position_ = limit_ = 0;
   allocation_size_ = 0;
   segment_head_ = nullptr;
+  soft_limit_reported_ = false;
+}
+
+void Zone::SetMemoryBudget(size_t soft_limit, size_t hard_limit,
+                           MemoryBudgetCallback callback, void* data) {
+  // DCHECK(hard_limit == 0 || soft_limit <= hard_limit);
+  soft_limit_ = soft_limit;
+  hard_limit_ = hard_limit;
+  budget_callback_ = callback;
+  budget_callback_data_ = data;
+  soft_limit_reported_ = false;
+}
+
+bool Zone::WithinHardLimit(size_t size) const {
+  if (hard_limit_ == 0) return true;
+  return segment_bytes_allocated_ <= hard_limit_ &&
+         size <= hard_limit_ - segment_bytes_allocated_;
 }
 
 void* Zone::New(size_t size) {
+#if defined(ZONE_ALLOCATION_TRACE)
+  // Record the request as made by the caller so it can be replayed.
+  ZoneTraceSink* trace_sink = allocator_->trace_sink();
+  if (trace_sink != nullptr) trace_sink->ZoneAllocated(this, size);
+#endif // defined(ZONE_ALLOCATION_TRACE)
+
   // Round up the requested size to fit the alignment.
   size = RoundUp(size, kAlignment);
 
@@ -70,6 +103,8 @@ void* Zone::New(size_t size) {
   // NewExpand should only be called if there isn't enough room in the Zone already.
   if (limit < position || size_with_redzone > limit - position) {
     result = NewExpand(size_with_redzone);
+    // The memory budget was exhausted; leave the zone untouched.
+    if (result == nullptr) return nullptr;
   } else {
     position_ += size_with_redzone;
   }
@@ -84,13 +119,51 @@ void* Zone::New(size_t size) {
   return reinterpret_cast<void*>(result);
 }
 
+bool Zone::TryExtend(void* ptr, size_t old_size, size_t new_size) {
+  // DCHECK_LE(old_size, new_size);
+  old_size = RoundUp(old_size, kAlignment);
+  new_size = RoundUp(new_size, kAlignment);
+
+  // Only the last allocation before position_ can grow, and New() placed
+  // its redzone right behind it.
+  Address start = reinterpret_cast<Address>(ptr);
+  if (start == nullptr || start + old_size + kASanRedzoneBytes != position_) {
+    return false;
+  }
+
+  const size_t delta = new_size - old_size;
+  const uintptr_t limit = reinterpret_cast<uintptr_t>(limit_);
+  const uintptr_t position = reinterpret_cast<uintptr_t>(position_);
+  if (limit < position || delta > limit - position) return false;
+
+  ASAN_UNPOSITION_MEMORY_REGION(start + old_size, kASanRedzoneBytes);
+  position_ += delta;
+  ASAN_POSITION_MEMORY_REGION(start + new_size, kASanRedzoneBytes);
+  allocation_size_ += delta;
+
+#if defined(ZONE_ALLOCATION_TRACE)
+  // Replay in-place growth as an allocation of the added bytes, which has
+  // the same effect on the zone's allocation size.
+  ZoneTraceSink* trace_sink = allocator_->trace_sink();
+  if (trace_sink != nullptr && delta != 0) {
+    trace_sink->ZoneAllocated(this, delta);
+  }
+#endif // defined(ZONE_ALLOCATION_TRACE)
+  return true;
+}
+
 // Creates a new segment, sets it size, and pushes it to the front
 // of the segment chain. Returns the new segment.
 Segment* Zone::NewSegment(size_t requested_size) {
-  Segment* result = allocator_->GetSegment(requested_size);
-  // DCHECK_GE(result->size(), requested_size);
-  segment_bytes_allocated_ += result->size();
+  // Never take a pooled segment that would push the zone over its budget;
+  // NewExpand() has made sure 'requested_size' itself fits.
+  const size_t max_size =
+      hard_limit_ == 0 ? 0 : hard_limit_ - segment_bytes_allocated_;
+  Segment* result = allocator_->GetSegment(requested_size, max_size);
   if (result != nullptr) {
+    // DCHECK_GE(result->size(), requested_size);
+    // DCHECK(max_size == 0 || result->size() <= max_size);
+    segment_bytes_allocated_ += result->size();
     result->set_zone(this);
     result->set_next(segment_head_);
     segment_head_ = result;
@@ -133,10 +206,34 @@ Adress Zone::NexExpand(size_t size) {
     FatalProcessOutOfMemory("Zone");
     return nullptr;
   }
+  // Enforce the hard budget. Fall back to the smallest segment that can
+  // hold the request before giving up; failing here is a controlled
+  // out-of-memory that the caller observes as New() returning nullptr.
+  if (!WithinHardLimit(new_size)) {
+    if (!WithinHardLimit(min_new_size)) return nullptr;
+    new_size = min_new_size;
+  }
   Segment* segment = NewSegment(new_size);
   if (segment == nullptr) {
+    // Running into a configured budget is a controlled failure; anything
+    // else is a genuine out-of-memory.
+    if (hard_limit_ == 0 && allocator_->hard_limit() == 0) {
       FatalProcessOutOfMemory("Zone");
-      return nullptr;
+    }
+    return nullptr;
+  }
+  // Notify the embedder the first time the soft budget is crossed so it can
+  // shed load before the hard limit is reached.
+  if (soft_limit_ != 0 && !soft_limit_reported_ &&
+      segment_bytes_allocated_ > soft_limit_) {
+    soft_limit_reported_ = true;
+    if (budget_callback_ != nullptr) {
+      budget_callback_(name_, segment_bytes_allocated_, soft_limit_,
+                       budget_callback_data_);
+    } else {
+      fprintf(stderr, "Zone %s: excess allocation of %zu bytes (limit %zu)\n",
+              name_, segment_bytes_allocated_, soft_limit_);
+    }
   }
   // Recompute 'top' and 'limit' based on the new segment.
   Address result = RoundUp(segment->start(), kAlignment);
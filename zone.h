@@ -19,7 +19,31 @@ class Zone final {
 
     // Allocate 'size' bytes of memory in the Zone; expands the Zone by
     // allocating new segments of memory on demand using malloc().
+    // Returns nullptr if the hard memory budget of the zone (or of its
+    // allocator) would be exceeded.
     void* New(size_t size);
+
+    // Grows the allocation at 'ptr' from 'old_size' to 'new_size' bytes in
+    // place. This succeeds in O(1) only if 'ptr' is the most recent
+    // allocation in the zone and the current segment has enough room left;
+    // otherwise the zone is left untouched and false is returned.
+    bool TryExtend(void* ptr, size_t old_size, size_t new_size);
+
+    // Sets the memory budgets for segment memory held by this zone. A limit
+    // of 0 disables the respective check. When the segment bytes first
+    // exceed |soft_limit| the |callback| is invoked with |data|, or the
+    // excess is printed to stderr if there is no callback. An expansion that
+    // would exceed |hard_limit| fails and New() returns nullptr. The budgets
+    // are only checked when the zone expands, so the bump pointer fast path
+    // in New() is unaffected.
+    void SetMemoryBudget(size_t soft_limit, size_t hard_limit,
+                         MemoryBudgetCallback callback, void* data);
+
+    // The number of bytes handed out by New(), and the number of bytes held
+    // in segments. The difference is the zone's internal fragmentation.
+    size_t allocation_size() const { return allocation_size_; }
+    size_t segment_bytes_allocated() const { return segment_bytes_allocated_; }
+
   private:
     // Expand the Zone to hold at least 'size' more bytes and allocate
     // the bytes. Returns the address of the newly allocated chunk of
@@ -37,9 +61,15 @@ class Zone final {
     // Never allocate segments larger than this size in bytes.
     static const size_t kMaximumSegmentSize = 1 * MB;
 
-    // Report zone excess when allocation exceeds this limit.
+    // Report zone excess when allocation exceeds this limit. This is the
+    // default soft memory budget of every zone; without a budget callback
+    // the excess is reported on stderr.
     static const size_t kExcessLimit = 256 * MB;
 
+    // Returns false if growing the segment bytes by 'size' would exceed the
+    // hard memory budget.
+    inline bool WithinHardLimit(size_t size) const;
+
     // Deletes all objects and free all memory allocated in the Zone.
     void DeleteAll();
 
@@ -49,7 +79,15 @@ class Zone final {
     // The number of bytes allocated in segments. Note that this number
     // includes memory allocated from the OS but not yet allocated from
     // the zone.
-    size_t segment_bytes_allocated;
+    size_t segment_bytes_allocated_;
+
+    // Memory budgets on segment_bytes_allocated_; 0 means unlimited.
+    size_t soft_limit_;
+    size_t hard_limit_;
+    // Set once the soft limit callback has fired, cleared by DeleteAll().
+    bool soft_limit_reported_;
+    MemoryBudgetCallback budget_callback_;
+    void* budget_callback_data_;
 
     // The free region in the current (front) segment is represented as
     // the half-open interval [position, limit]. The 'position' variable